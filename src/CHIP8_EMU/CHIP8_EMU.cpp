@@ -6,6 +6,7 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <stdexcept>
 
 
 #include <SDL/include/SDL.h>
@@ -13,11 +14,12 @@
 #include <nfd.h>
 
 #include "chip8.h"
+#include "chip8Env.h"
+#include "frameCapture.h"
+#include "romAnalysis.h"
+#include "upscaler.h"
 
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 480
-
-int bootSDL(SDL_Window* & window, SDL_Renderer* & renderer, SDL_Surface* & screenSurface) {
+int bootSDL(SDL_Window* & window, SDL_Renderer* & renderer, SDL_Surface* & screenSurface, int width, int height) {
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "Could not init SDL2: %s\n", SDL_GetError());
         return 1;
@@ -25,7 +27,7 @@ int bootSDL(SDL_Window* & window, SDL_Renderer* & renderer, SDL_Surface* & scree
     window = SDL_CreateWindow(
         "hello_SDL",
         SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        SCREEN_WIDTH, SCREEN_HEIGHT,
+        width, height,
         SDL_WINDOW_SHOWN
     );
 	renderer = SDL_CreateRenderer(window, 0, 0);
@@ -41,9 +43,9 @@ void clearScreen(SDL_Renderer* & renderer) {
 	SDL_RenderClear(renderer);
 	SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
 }
-void setupGraphics(SDL_Renderer* & renderer) {
+void setupGraphics(SDL_Renderer* & renderer, Upscaler& upscaler, const UpscaleSettings& settings) {
 	clearScreen(renderer);
-    SDL_RenderSetScale(renderer, 5, 5);
+	upscaler.setup(renderer, settings);
 }
 void setupInput() {
     // TODO
@@ -97,17 +99,168 @@ const Uint8* evaluateSDLinput() {
 	return SDL_GetKeyboardState(NULL);
 }
 
-void drawGraphics(SDL_Renderer* & renderer, std::array<unsigned char, 2048> gfx, int width_res, int height_res) {
-	// Res = 64 * 32
-	for (int y = 0; y < height_res; ++y) {
-		for (int x = 0; x < width_res; ++x) {
-            if (gfx[y * width_res + x] == 1) {
-                SDL_RenderDrawPoint(renderer, x, y);
-            }
+void drawGraphics(SDL_Renderer* & renderer, Upscaler& upscaler, const std::array<unsigned char, 2048>& gfx) {
+	// Res = 64 * 32, scaled up on the CPU into the upscaler's texture
+	upscaler.render(gfx);
+	upscaler.present(renderer);
+}
+
+bool parseIntArg(const char* text, int& value) {
+	// std::stoi throws on garbage, so bad arguments are reported and ignored instead
+	try {
+		value = std::stoi(text);
+		return true;
+	}
+	catch (const std::exception&) {
+		printf("Ignoring invalid number: %s\n", text);
+		return false;
+	}
+}
+
+void parseDisplayArgs(int argc, char *argv[], UpscaleSettings& settings) {
+	// --scale <n>, --filter <none|scale2x|scale3x|epx>, --scanlines, --persistence <0-255>
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--scale" && hasValue) {
+			parseIntArg(argv[++i], settings.scale);
+		}
+		else if (arg == "--filter" && hasValue) {
+			std::string filter = argv[++i];
+			if (filter == "scale2x")
+				settings.filter = SmoothingFilter::Scale2x;
+			else if (filter == "scale3x")
+				settings.filter = SmoothingFilter::Scale3x;
+			else if (filter == "epx")
+				settings.filter = SmoothingFilter::EPX;
+			else if (filter == "none")
+				settings.filter = SmoothingFilter::None;
+			else
+				printf("Ignoring invalid filter: %s\n", filter.c_str());
+		}
+		else if (arg == "--scanlines") {
+			settings.scanlines = true;
+		}
+		else if (arg == "--persistence" && hasValue) {
+			parseIntArg(argv[++i], settings.persistence);
 		}
 	}
-	
+	if (settings.scale < 1)
+		settings.scale = 1;
+	if (settings.scale > Upscaler::maxScale)
+		settings.scale = Upscaler::maxScale;
+	if (settings.persistence < 0)
+		settings.persistence = 0;
+	if (settings.persistence > 255)
+		settings.persistence = 255;
+}
+bool parseCaptureArgs(int argc, char *argv[], CaptureSettings& settings) {
+	// --capture-ppm <prefix> | --capture-y4m <file> | --capture-hash <file>
+	// optional: --capture-scale <n>, --capture-coalesce
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--capture-ppm" && hasValue) {
+			settings.format = CaptureFormat::PPM;
+			settings.path = argv[++i];
+		}
+		else if (arg == "--capture-y4m" && hasValue) {
+			settings.format = CaptureFormat::Y4M;
+			settings.path = argv[++i];
+		}
+		else if (arg == "--capture-hash" && hasValue) {
+			settings.format = CaptureFormat::Hashes;
+			settings.path = argv[++i];
+		}
+		else if (arg == "--capture-scale" && hasValue) {
+			parseIntArg(argv[++i], settings.scale);
+		}
+		else if (arg == "--capture-coalesce") {
+			settings.policy = DropPolicy::Coalesce;
+		}
+	}
+	if (settings.scale < 1)
+		settings.scale = 1;
+	if (settings.scale > FrameCapture::maxScale)
+		settings.scale = FrameCapture::maxScale;
+	return settings.format != CaptureFormat::None;
+}
+
+bool parseSeedArgs(int argc, char *argv[], int& seed) {
+	// --seed <n>: fixes the 0xCXNN random numbers, so runs can be repeated exactly
+	bool seeded = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--seed" && i + 1 < argc)
+			seeded = parseIntArg(argv[++i], seed) || seeded;
+	}
+	return seeded;
 }
+
+bool parseEnvBenchmarkArgs(int argc, char *argv[], int& batchSize, int& steps) {
+	// --env-benchmark <instances> <steps>: runs the ROM headless through Chip8Env and exits
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--env-benchmark" && i + 2 < argc) {
+			bool valid = parseIntArg(argv[i + 1], batchSize);
+			valid = parseIntArg(argv[i + 2], steps) && valid;
+			if (!valid)
+				return false;
+			if (batchSize < 1)
+				batchSize = 1;
+			if (steps < 1)
+				steps = 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void runEnvBenchmark(const Chip8& start, int batchSize, int steps) {
+	Chip8Env env(start, batchSize);
+	std::vector<unsigned char> observations(batchSize * Chip8Env::observationSize);
+	std::vector<float> rewards(batchSize);
+	std::vector<unsigned short> actions(batchSize);
+	std::mt19937 actionEngine{ 0 };
+
+	env.reset(nullptr, observations.data());
+	Uint64 startCounter = SDL_GetPerformanceCounter();
+	for (int step = 0; step < steps; ++step) {
+		// One random key held per instance per step
+		for (auto& action : actions)
+			action = (unsigned short)(1 << (actionEngine() & 0xF));
+		env.step(actions.data(), observations.data(), rewards.data());
+	}
+	double seconds = (double)(SDL_GetPerformanceCounter() - startCounter) / SDL_GetPerformanceFrequency();
+
+	unsigned long long totalSteps = (unsigned long long)batchSize * steps;
+	printf("ENV: %d instances x %d steps in %.3fs, %.0f environment steps per second\n",
+		batchSize, steps, seconds, seconds > 0 ? totalSteps / seconds : 0.0);
+}
+
+enum class QuirkSetting { Off, On, Auto };
+
+QuirkSetting parseQuirkArgs(int argc, char *argv[]) {
+	// --quirk-bxnn <off|on|auto>: SUPER-CHIP 0xBXNN jump. auto follows the ROM
+	// analysis' platform guess, and is only used when asked for
+	QuirkSetting bxnn = QuirkSetting::Off;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--quirk-bxnn" && i + 1 < argc) {
+			std::string value = argv[++i];
+			if (value == "off")
+				bxnn = QuirkSetting::Off;
+			else if (value == "on")
+				bxnn = QuirkSetting::On;
+			else if (value == "auto")
+				bxnn = QuirkSetting::Auto;
+			else
+				printf("Ignoring invalid quirk setting: %s\n", value.c_str());
+		}
+	}
+	return bxnn;
+}
+
 constexpr auto tick_interval = 1000.f / 120.f; 
 // This is kind of arbitrary and dependant on hardware, and each game
 // The 1000 is the milliseconds per second, and the right hand side is how many ticks (instructions) per second
@@ -131,17 +284,29 @@ int main(int argc, char *argv[])
 	SDL_Renderer* renderer = nullptr;
     SDL_Surface* screenSurface = nullptr;
     
-    bootSDL(window, renderer, screenSurface);
-	setupGraphics(renderer);
+	UpscaleSettings upscaleSettings;
+	parseDisplayArgs(argc, argv, upscaleSettings);
+	Upscaler upscaler;
+
+    bootSDL(window, renderer, screenSurface,
+		Upscaler::sourceWidth * upscaleSettings.scale, Upscaler::sourceHeight * upscaleSettings.scale);
+	setupGraphics(renderer, upscaler, upscaleSettings);
 
     Chip8 myChip8;
 	myChip8.initialise();
 
 
+	RomAnalysis romAnalysis;
     nfdchar_t* filePath = nullptr;
     bool fileSelected = getUserFileChoice(filePath);
     if (fileSelected && fileIsChip8(filePath)) {
-        myChip8.loadGame(filePath);
+		loadAnalysedGame(filePath, myChip8, romAnalysis);
+		bool looksSuperChip = romAnalysis.platform == RomPlatform::SuperChip;
+		if (looksSuperChip)
+			puts("WARNING: ROM looks like it uses SUPER-CHIP opcodes, only the 0xBXNN jump (--quirk-bxnn) is supported");
+
+		QuirkSetting bxnn = parseQuirkArgs(argc, argv);
+		myChip8.jumpUsesVX = bxnn == QuirkSetting::On || (bxnn == QuirkSetting::Auto && looksSuperChip);
     }
     else {
         // For now, if user cancels, program just closes to prevent undefined behaviour
@@ -149,6 +314,29 @@ int main(int argc, char *argv[])
         SDL_Delay(2000);
         return 0;
     }
+
+	int benchmarkBatch = 0;
+	int benchmarkSteps = 0;
+	if (parseEnvBenchmarkArgs(argc, argv, benchmarkBatch, benchmarkSteps)) {
+		runEnvBenchmark(myChip8, benchmarkBatch, benchmarkSteps);
+		upscaler.release();
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+		return 0;
+	}
+
+	FrameCapture capture;
+	CaptureSettings captureSettings;
+	captureSettings.fps = 120; // One present per tick, see tick_interval
+	if (parseCaptureArgs(argc, argv, captureSettings))
+		capture.start(captureSettings);
+
+	// Golden hashes are useless if random sprites differ between runs, so hash
+	// capture always runs seeded (0 unless --seed says otherwise)
+	int seed = 0;
+	if (parseSeedArgs(argc, argv, seed) || captureSettings.format == CaptureFormat::Hashes)
+		myChip8.seedRandom((unsigned int)seed);
 	
     int opcodesPerSecond = 600;
     Uint32 nextTime = SDL_GetTicks() + tick_interval;
@@ -157,21 +345,31 @@ int main(int argc, char *argv[])
 		// Store key press state (Press and Release)
 		myChip8.setKeys(evaluateSDLinput());
 
-		myChip8.emulateCycle();
+		// Same as emulateCycle(), but just ticks the timers while parked in an idle loop
+		myChip8.emulateCycles(1);
 
 		// If the draw flag is set, update the screen
-		if (myChip8.drawFlag) {
+		// (keep going while persistence is fading old pixels out)
+		if (myChip8.drawFlag || upscaler.animating()) {
 			clearScreen(renderer);
-			drawGraphics(renderer, myChip8.graphics, 64, 32);
+			drawGraphics(renderer, upscaler, myChip8.graphics);
 			SDL_RenderPresent(renderer);
 		}
+		// Only frames the emulator drew are captured, fade-only redraws depend on
+		// display settings and would change the capture
+		if (myChip8.drawFlag)
+			capture.submit(myChip8.graphics);
+		if (SDL_QuitRequested())
+			break;
 		auto left = time_left(nextTime);
 		printf("%i\n",left);
         SDL_Delay(left);
         nextTime += tick_interval;
     }
 
+	capture.stop();
     SDL_Delay(2000);
+	upscaler.release();
 	SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
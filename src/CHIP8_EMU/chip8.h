@@ -8,6 +8,7 @@
 #include <vector>
 #include <string>
 #include <array>
+#include <bitset>
 
 
 class Chip8 {
@@ -34,6 +35,9 @@ public:
 
 	bool drawFlag = false;
 
+	// Skips the console output (beeps, unknown opcodes), for headless and batched runs
+	bool quiet = false;
+
 	// No interupts/hardware registers
 	
 	// Timer registers at 60Hz, when > 0, they count down to 0
@@ -50,6 +54,13 @@ public:
 	std::array<unsigned char, 16> key;
 	unsigned char lastPressedKey;
 
+	// Addresses a ROM analysis (see romAnalysis.h) found the program can park at:
+	// jumps to themselves and 0xFX0A key waits. Only used by emulateCycles()
+	std::bitset<4096> idleLoops;
+
+	// SUPER-CHIP reads 0xBNNN as 0xBXNN, jumping to XNN plus VX instead of NNN plus V0
+	bool jumpUsesVX = false;
+
 	std::array<unsigned char, 80> chip8_fontset =
 	{
 		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -105,6 +116,10 @@ public:
         clearMemory();
 		clearKeys();
 
+		// Anything a ROM analysis set belongs to the previous game
+		idleLoops.reset();
+		jumpUsesVX = false;
+
 		// Load fontset
 		for (int i = 0; i < 80; ++i) {
 			memory[i] = chip8_fontset[i];
@@ -127,13 +142,16 @@ public:
 
 	void setCarry(bool on) { registerV[0xF] = on; }
 
+	// Seeded once from hardware, rather than building a random_device for every 0xCXNN
+	std::mt19937 randomEngine{ std::random_device{}() };
+
+	void seedRandom(unsigned int seed) { randomEngine.seed(seed); }
+
 	int randRange(int min, int max) {
 		// https://stackoverflow.com/questions/7560114/random-number-c-in-some-range
-		std::random_device rd; // obtain random number from hardware
-		std::mt19937 engine{ rd() }; // seed the generator
 		std::uniform_int_distribution<int> distr{ min, max };
 
-		return distr(engine);
+		return distr(randomEngine);
 	}
 
 	void setKeys(const Uint8* keyboardState) {
@@ -170,6 +188,19 @@ public:
 		key[0xE] = keyboardState[SDL_SCANCODE_F];
 		key[0xF] = keyboardState[SDL_SCANCODE_V];
 
+		updateLastPressedKey();
+	}
+
+	void setKeyMask(unsigned short keyMask) {
+		// Same as setKeys, but without SDL - bit N set means key N is held
+		prevKey = key;
+		for (int i = 0; i < 16; ++i) {
+			key[i] = (keyMask >> i) & 1;
+		}
+		updateLastPressedKey();
+	}
+
+	void updateLastPressedKey() {
 		for (int i = 0; i < 16; ++i) {
 			if (key[i] != prevKey[i]) {
 				lastPressedKey = i;
@@ -179,6 +210,41 @@ public:
 	}
 
 
+	bool parkedAtIdleLoop() const {
+		// Memory can be rewritten at runtime, so check the opcode is still the idle one
+		if (!idleLoops[programCounter & 0xFFF])
+			return false;
+		unsigned short op = memory[programCounter & 0xFFF] << 8 | memory[(programCounter + 1) & 0xFFF];
+		if (op == (0x1000 | programCounter))
+			return true; // Jumps to itself forever
+		if ((op & 0xF0FF) == 0xF00A && prevKey == key)
+			return true; // Waiting on a key, and keys only change between setKeys calls
+		return false;
+	}
+
+	void tickTimers(int cycles) {
+		// What 'cycles' calls to emulateCycle() would do to the timers
+		delayTimer = delayTimer > cycles ? delayTimer - cycles : 0;
+		if (soundTimer > 0) {
+			if (soundTimer <= cycles && !quiet)
+				printf("BEEP!\n");
+			soundTimer = soundTimer > cycles ? soundTimer - cycles : 0;
+		}
+	}
+
+	void emulateCycles(int cycles) {
+		// Once parked in an idle loop nothing but the timers can change until the
+		// keys do, so the rest of the cycles are skipped
+		for (int c = 0; c < cycles; ++c) {
+			if (parkedAtIdleLoop()) {
+				opcode = memory[programCounter] << 8 | memory[programCounter + 1];
+				tickTimers(cycles - c);
+				return;
+			}
+			emulateCycle();
+		}
+	}
+
     void emulateCycle() {
         // Fetch opcode
 		// Each one is 2 bytes that has to be combined
@@ -339,7 +405,8 @@ public:
 				break;
 			}
             default:
-                printf("UNKNOWN OPCODE: 0x%X\n", opcode);
+                if (!quiet)
+                    printf("UNKNOWN OPCODE: 0x%X\n", opcode);
                 programCounter += 2;
                 break;
             }
@@ -359,7 +426,7 @@ public:
         }
 		case 0xB000: { // 0xBNNN: Jumps to address NNN plus V0
 			stack[stackPointer] = programCounter;
-			programCounter = (opcode & 0x0FFF) + registerV[0];
+			programCounter = (opcode & 0x0FFF) + registerV[jumpUsesVX ? (opcode & 0x0F00) >> 8 : 0];
 			break;
 		}
 		case 0xC000: { // 0xCXNN: Sets VX to bitwise AND on a random number and NN
@@ -413,7 +480,8 @@ public:
 				break;
 			}
 			default:
-				printf("UNKNOWN OPCODE: 0x%X\n", opcode);
+				if (!quiet)
+					printf("UNKNOWN OPCODE: 0x%X\n", opcode);
 				programCounter += 2;
 				break;
 			}
@@ -491,7 +559,8 @@ public:
 				break;
 			}
 			default:
-				printf("UNKNOWN OPCODE: 0x%X\n", opcode);
+				if (!quiet)
+					printf("UNKNOWN OPCODE: 0x%X\n", opcode);
 				programCounter += 2;
                 break;
 			}
@@ -499,7 +568,8 @@ public:
 			break;
 		}
 		default:
-			printf("UNKNOWN OPCODE: 0x%X\n", opcode);
+			if (!quiet)
+				printf("UNKNOWN OPCODE: 0x%X\n", opcode);
 			programCounter += 2;
             break;
 		}
@@ -510,7 +580,8 @@ public:
 
 		if (soundTimer > 0) {
 			if (soundTimer == 1)
-				printf("BEEP!\n");
+				if (!quiet)
+					printf("BEEP!\n");
 			--soundTimer;
 		}
     }
@@ -0,0 +1,235 @@
+﻿#pragma once
+#include "stdafx.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <SDL/include/SDL.h>
+
+#include "chip8.h"
+
+// Batched environment for training agents on CHIP-8 games.
+// Holds batchSize independent Chip8 instances, all reset from one shared start
+// snapshot (usually one filled in by loadAnalysedGame() from romAnalysis.h).
+// Every buffer is owned by the caller and everything else is sized in the
+// constructor, so reset()/step() never allocate. Instances are split into fixed
+// contiguous ranges, one per worker thread, and the calling thread does a share too.
+// With the ROM's analysis applied to the snapshot, instances parked in an idle
+// loop skip the rest of their step.
+
+// Reward is (new value - old value) * scale for the byte at address, summed over hooks
+struct RewardHook {
+	unsigned short address;
+	float scale;
+};
+
+class Chip8Env {
+public:
+	// 64 x 32 pixels at 1 bit per pixel, row-major, leftmost pixel in the high bit
+	static const size_t observationSize = 64 * 32 / 8;
+
+	Chip8Env(const Chip8& startState, size_t batchSize, int framesPerStep = 1, unsigned int threadCount = 0)
+		: start(startState), instances(batchSize, startState), episodes(batchSize, 0),
+		framesPerStep(framesPerStep) {
+		// Instances run on several threads, none should be fighting over stdout
+		start.quiet = true;
+		for (auto& chip : instances)
+			chip.quiet = true;
+
+		// Seeded here too, so stepping before the first reset() is just as repeatable
+		for (size_t i = 0; i < instances.size(); ++i)
+			instances[i].seedRandom(instanceSeed(i));
+
+		if (threadCount == 0)
+			threadCount = std::thread::hardware_concurrency();
+		if (threadCount == 0)
+			threadCount = 1;
+		if (threadCount > batchSize)
+			threadCount = (unsigned int)batchSize;
+		if (threadCount == 0)
+			threadCount = 1;
+
+		rangeCount = threadCount;
+		// Worker 0 is whichever thread calls step()/reset()
+		for (unsigned int i = 1; i < rangeCount; ++i) {
+			workers.emplace_back(&Chip8Env::workerLoop, this, i);
+		}
+	}
+
+	~Chip8Env() {
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			shuttingDown = true;
+			++generation;
+		}
+		jobStart.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	Chip8Env(const Chip8Env&) = delete;
+	Chip8Env& operator=(const Chip8Env&) = delete;
+
+	size_t size() const { return instances.size(); }
+
+	// Copied in, so the caller's vector can go away
+	void setRewardHooks(const std::vector<RewardHook>& hooks) { rewardHooks = hooks; }
+
+	// The main loop runs one opcode per 120Hz tick, so a 60Hz frame is two
+	void setCyclesPerFrame(int cycles) { cyclesPerFrame = cycles; }
+	void setFramesPerStep(int frames) { framesPerStep = frames; }
+
+	// Random seeds are derived from this, the instance index and its episode count,
+	// so a run is reproducible regardless of thread count. Reseeds every instance
+	// straight away as well as on later resets (the default base is 0)
+	void seed(unsigned int baseSeed) {
+		seedBase = baseSeed;
+		for (size_t i = 0; i < instances.size(); ++i)
+			instances[i].seedRandom(instanceSeed(i));
+	}
+
+	const Chip8& instance(size_t index) const { return instances[index]; }
+
+	// Restores the start snapshot into every instance with resetMask[i] != 0
+	// (or all of them if resetMask is null) and writes their observations.
+	// observations is size() * observationSize bytes, untouched for instances not reset
+	void reset(const unsigned char* resetMask, unsigned char* observations) {
+		jobResetMask = resetMask;
+		jobObservations = observations;
+		run(Job::Reset);
+	}
+
+	// Applies actions[i] as a 16-bit keypad mask (bit N = key N held) and runs each
+	// instance for framesPerStep frames. observations as reset(), rewards is size() floats
+	void step(const unsigned short* actions, unsigned char* observations, float* rewards) {
+		jobActions = actions;
+		jobObservations = observations;
+		jobRewards = rewards;
+		run(Job::Step);
+	}
+
+private:
+	enum class Job { Reset, Step };
+
+	Chip8 start;
+	std::vector<Chip8> instances;
+	std::vector<unsigned int> episodes;
+	std::vector<RewardHook> rewardHooks;
+	int framesPerStep;
+	int cyclesPerFrame = 2;
+	unsigned int seedBase = 0;
+
+	// Current job, published to workers under jobMutex via generation
+	Job job = Job::Step;
+	const unsigned char* jobResetMask = nullptr;
+	const unsigned short* jobActions = nullptr;
+	unsigned char* jobObservations = nullptr;
+	float* jobRewards = nullptr;
+
+	std::vector<std::thread> workers;
+	unsigned int rangeCount = 1;
+	std::mutex jobMutex;
+	std::condition_variable jobStart;
+	std::condition_variable jobDone;
+	unsigned long long generation = 0;
+	unsigned int workersRemaining = 0;
+	bool shuttingDown = false;
+
+	void run(Job nextJob) {
+		if (!workers.empty()) {
+			std::lock_guard<std::mutex> lock(jobMutex);
+			job = nextJob;
+			workersRemaining = (unsigned int)workers.size();
+			++generation;
+		}
+		else {
+			job = nextJob;
+		}
+		jobStart.notify_all();
+
+		runRange(0);
+
+		if (!workers.empty()) {
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobDone.wait(lock, [this] { return workersRemaining == 0; });
+		}
+	}
+
+	void workerLoop(unsigned int rangeIndex) {
+		unsigned long long seenGeneration = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(jobMutex);
+				jobStart.wait(lock, [&] { return generation != seenGeneration; });
+				seenGeneration = generation;
+				if (shuttingDown)
+					return;
+			}
+
+			runRange(rangeIndex);
+
+			{
+				std::lock_guard<std::mutex> lock(jobMutex);
+				if (--workersRemaining == 0)
+					jobDone.notify_one();
+			}
+		}
+	}
+
+	void runRange(unsigned int rangeIndex) {
+		size_t begin = instances.size() * rangeIndex / rangeCount;
+		size_t end = instances.size() * (rangeIndex + 1) / rangeCount;
+		for (size_t i = begin; i < end; ++i) {
+			if (job == Job::Reset)
+				resetInstance(i);
+			else
+				stepInstance(i);
+		}
+	}
+
+	unsigned int instanceSeed(size_t i) const {
+		return seedBase ^ (unsigned int)(i * 0x9E3779B9u) ^ (episodes[i] * 0x85EBCA6Bu);
+	}
+
+	void resetInstance(size_t i) {
+		if (jobResetMask && !jobResetMask[i])
+			return;
+		Chip8& chip = instances[i];
+		chip = start;
+		++episodes[i];
+		chip.seedRandom(instanceSeed(i));
+		packObservation(chip, jobObservations + i * observationSize);
+	}
+
+	void stepInstance(size_t i) {
+		Chip8& chip = instances[i];
+		float reward = 0.f;
+		for (const RewardHook& hook : rewardHooks)
+			reward -= chip.memory[hook.address & 0xFFF] * hook.scale;
+
+		chip.setKeyMask(jobActions[i]);
+		chip.emulateCycles(framesPerStep * cyclesPerFrame);
+
+		for (const RewardHook& hook : rewardHooks)
+			reward += chip.memory[hook.address & 0xFFF] * hook.scale;
+		jobRewards[i] = reward;
+
+		packObservation(chip, jobObservations + i * observationSize);
+	}
+
+	static void packObservation(const Chip8& chip, unsigned char* out) {
+		// Pixels are always 0 or 1, so eight of them read as one little-endian
+		// uint64 can be gathered into a byte with a single multiply
+		const unsigned char* pixels = chip.graphics.data();
+		for (size_t i = 0; i < observationSize; ++i) {
+			uint64_t eight;
+			std::memcpy(&eight, pixels + i * 8, 8);
+			out[i] = (unsigned char)((eight * 0x8040201008040201ULL) >> 56);
+		}
+	}
+};
@@ -0,0 +1,19 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// 64-bit FNV-1a, used anywhere we need a cheap stable hash of raw bytes
+// (frame hashes for golden comparisons, ROM content keys)
+// http://www.isthe.com/chongo/tech/comp/fnv/
+static const uint64_t fnvOffsetBasis = 0xCBF29CE484222325ULL;
+static const uint64_t fnvPrime = 0x100000001B3ULL;
+
+inline uint64_t fnv1a64(const unsigned char* data, size_t length, uint64_t seed = fnvOffsetBasis) {
+	uint64_t hash = seed;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= data[i];
+		hash *= fnvPrime;
+	}
+	return hash;
+}
@@ -0,0 +1,337 @@
+﻿#pragma once
+#include "stdafx.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fnv.h"
+
+// Snapshots each presented frame into a fixed pool of buffers, and hands them
+// to a background writer thread so slow disks never stall the emulation loop.
+// Nothing is allocated per frame on the emulation side - submit() is a 2KB copy.
+
+enum class CaptureFormat {
+	None,
+	PPM,    // One binary PPM (P6) per frame: <path>_000000.ppm, <path>_000001.ppm...
+	Y4M,    // Single raw YUV4MPEG2 stream, ffmpeg/mpv can read it directly
+	Hashes  // One line per frame: index, FNV-1a hash of the frame, rolling hash,
+	        // then "total <frames> <rolling hash>" when capture stops
+};
+
+enum class DropPolicy {
+	DropNewest, // Pool full: throw away the incoming frame
+	Coalesce    // Pool full: incoming frame replaces the newest frame still waiting
+};
+
+struct CaptureSettings {
+	CaptureFormat format = CaptureFormat::None;
+	DropPolicy policy = DropPolicy::DropNewest;
+	std::string path;
+	int scale = 1;  // Pixel scale for PPM/Y4M (1 to maxScale), hashes are always taken of the raw frame
+	int fps = 60;   // Only written into the Y4M header
+};
+
+class FrameCapture {
+public:
+	static const int width = 64;
+	static const int height = 32;
+	static const int poolSize = 16;
+	static const int maxScale = 64;
+
+	typedef std::array<unsigned char, width * height> Frame;
+
+	FrameCapture() {}
+	~FrameCapture() { stop(); }
+
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	bool start(const CaptureSettings& captureSettings) {
+		stop();
+		settings = captureSettings;
+		if (settings.format == CaptureFormat::None)
+			return false;
+		if (settings.scale < 1)
+			settings.scale = 1;
+		if (settings.scale > maxScale)
+			settings.scale = maxScale;
+		if (settings.format == CaptureFormat::Y4M && (settings.scale & 1))
+			++settings.scale; // 4:2:0 chroma needs even dimensions
+
+		// Everything the writer needs is sized once, up front
+		const int outWidth = width * settings.scale;
+		const int outHeight = height * settings.scale;
+		if (settings.format == CaptureFormat::PPM)
+			scratch.assign(outWidth * outHeight * 3, 0);
+		else if (settings.format == CaptureFormat::Y4M)
+			scratch.assign(outWidth * outHeight + 2 * (outWidth / 2) * (outHeight / 2), 0);
+
+		if (settings.format == CaptureFormat::PPM) {
+			// Frames are opened one by one on the writer, so check the folder is
+			// writable now, while start() can still say no
+			std::string probePath = ppmPath(0);
+			std::ofstream probe(probePath, std::ios::binary | std::ios::trunc);
+			if (!probe) {
+				printf("CAPTURE: Could not write %s\n", probePath.c_str());
+				return false;
+			}
+			probe.close();
+			std::remove(probePath.c_str());
+		}
+		else {
+			out.open(settings.path, std::ios::binary | std::ios::trunc);
+			if (!out) {
+				printf("CAPTURE: Could not open %s\n", settings.path.c_str());
+				return false;
+			}
+			if (settings.format == CaptureFormat::Y4M) {
+				out << "YUV4MPEG2 W" << outWidth << " H" << outHeight
+					<< " F" << settings.fps << ":1 Ip A1:1 C420jpeg\n";
+			}
+		}
+
+		tail = 0;
+		count = 0;
+		writerBusy = false;
+		stopping = false;
+		nextFrameIndex = 0;
+		rollingHash = fnvOffsetBasis;
+		framesSubmitted = 0;
+		framesWritten = 0;
+		framesFailed = 0;
+		framesDropped = 0;
+		framesCoalesced = 0;
+
+		writer = std::thread(&FrameCapture::writerLoop, this);
+		return true;
+	}
+
+	void stop() {
+		if (!writer.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			stopping = true;
+		}
+		frameReady.notify_one();
+		writer.join(); // Writer drains whatever is still queued before exiting
+		if (settings.format == CaptureFormat::Hashes) {
+			// The last frames may have been dropped, this line always has the final chain
+			char line[64];
+			int length = snprintf(line, sizeof(line), "total %llu %016llx\n",
+				nextFrameIndex, (unsigned long long)rollingHash);
+			out.write(line, length);
+		}
+		out.flush();
+		bool streamFailed = out.is_open() && !out;
+		out.close();
+
+		printf("CAPTURE: %llu frames presented, %llu written, %llu failed, %llu dropped, %llu coalesced\n",
+			framesSubmitted.load(), framesWritten.load(), framesFailed.load(),
+			framesDropped.load(), framesCoalesced.load());
+		if (streamFailed)
+			printf("CAPTURE: Writing %s failed, the output is incomplete\n", settings.path.c_str());
+	}
+
+	bool active() const { return writer.joinable(); }
+
+	// Called from the emulation thread after each present
+	void submit(const Frame& graphics) {
+		if (!active())
+			return;
+		unsigned long long frameIndex = nextFrameIndex++;
+		++framesSubmitted;
+
+		// Hashed here rather than on the writer, so the rolling hash covers every
+		// presented frame no matter what the drop policy throws away
+		uint64_t frameHash = 0;
+		if (settings.format == CaptureFormat::Hashes) {
+			frameHash = fnv1a64(graphics.data(), graphics.size());
+			rollingHash = fnv1a64(graphics.data(), graphics.size(), rollingHash);
+		}
+		{
+			std::lock_guard<std::mutex> lock(poolMutex);
+			if (count == poolSize) {
+				// Writer is behind - never wait on it
+				int pending = count - (writerBusy ? 1 : 0);
+				if (settings.policy == DropPolicy::Coalesce && pending > 0) {
+					Slot& newest = pool[(tail + count - 1) % poolSize];
+					newest.pixels = graphics;
+					newest.index = frameIndex;
+					newest.frameHash = frameHash;
+					newest.rollingHash = rollingHash;
+					++framesCoalesced;
+				}
+				else {
+					++framesDropped;
+				}
+				return;
+			}
+			Slot& slot = pool[(tail + count) % poolSize];
+			slot.pixels = graphics;
+			slot.index = frameIndex;
+			slot.frameHash = frameHash;
+			slot.rollingHash = rollingHash;
+			++count;
+		}
+		frameReady.notify_one();
+	}
+
+	unsigned long long dropped() const { return framesDropped; }
+	unsigned long long coalesced() const { return framesCoalesced; }
+	unsigned long long written() const { return framesWritten; }
+	unsigned long long failed() const { return framesFailed; }
+
+private:
+	struct Slot {
+		Frame pixels;
+		unsigned long long index;
+		uint64_t frameHash;
+		uint64_t rollingHash;
+	};
+
+	CaptureSettings settings;
+	std::array<Slot, poolSize> pool;
+
+	// Pool state, guarded by poolMutex. The slot at 'tail' belongs to the writer
+	// while writerBusy is set, so submit() never touches it
+	std::mutex poolMutex;
+	std::condition_variable frameReady;
+	int tail = 0;
+	int count = 0;
+	bool writerBusy = false;
+	bool stopping = false;
+
+	std::thread writer;
+	std::ofstream out;
+	std::vector<unsigned char> scratch;
+	// Emulation thread only
+	uint64_t rollingHash = fnvOffsetBasis;
+	unsigned long long nextFrameIndex = 0;
+
+	std::atomic<unsigned long long> framesSubmitted{ 0 };
+	std::atomic<unsigned long long> framesWritten{ 0 };
+	std::atomic<unsigned long long> framesFailed{ 0 }; // Reached the writer, but couldn't be written
+	std::atomic<unsigned long long> framesDropped{ 0 };
+	std::atomic<unsigned long long> framesCoalesced{ 0 };
+
+	void writerLoop() {
+		for (;;) {
+			int slotIndex;
+			{
+				std::unique_lock<std::mutex> lock(poolMutex);
+				frameReady.wait(lock, [this] { return count > 0 || stopping; });
+				if (count == 0)
+					return; // Stopping, and fully drained
+				writerBusy = true;
+				slotIndex = tail;
+			}
+
+			if (writeFrame(pool[slotIndex]))
+				++framesWritten;
+			else
+				++framesFailed;
+
+			{
+				std::lock_guard<std::mutex> lock(poolMutex);
+				tail = (tail + 1) % poolSize;
+				--count;
+				writerBusy = false;
+			}
+		}
+	}
+
+	bool writeFrame(const Slot& slot) {
+		switch (settings.format) {
+		case CaptureFormat::PPM: return writePPM(slot);
+		case CaptureFormat::Y4M: return writeY4M(slot);
+		case CaptureFormat::Hashes: return writeHash(slot);
+		default: return false;
+		}
+	}
+
+	std::string ppmPath(unsigned long long frameIndex) const {
+		char fileName[32];
+		snprintf(fileName, sizeof(fileName), "_%06llu.ppm", frameIndex);
+		return settings.path + fileName;
+	}
+
+	// Matches the draw colour set up in clearScreen(), red on black
+	static constexpr unsigned char onR = 255, onG = 0, onB = 0;
+
+	bool writePPM(const Slot& slot) {
+		const int s = settings.scale;
+		const int outWidth = width * s;
+		const int outHeight = height * s;
+		unsigned char* dst = scratch.data();
+		for (int y = 0; y < outHeight; ++y) {
+			const unsigned char* row = &slot.pixels[(y / s) * width];
+			for (int x = 0; x < outWidth; ++x) {
+				bool on = row[x / s] != 0;
+				*dst++ = on ? onR : 0;
+				*dst++ = on ? onG : 0;
+				*dst++ = on ? onB : 0;
+			}
+		}
+
+		std::ofstream file(ppmPath(slot.index), std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+		file << "P6\n" << outWidth << " " << outHeight << "\n255\n";
+		file.write(reinterpret_cast<const char*>(scratch.data()), scratch.size());
+		file.close();
+		return !file.fail();
+	}
+
+	// The stream is buffered, so a failure may only show up a few frames late,
+	// and anything still buffered is checked in stop()
+	bool writeY4M(const Slot& slot) {
+		// Full range BT.601 for the foreground colour, black is (0, 128, 128)
+		static constexpr int onY = (299 * onR + 587 * onG + 114 * onB) / 1000;
+		static constexpr int onU = 128 + (-169 * onR - 331 * onG + 500 * onB) / 1000;
+		static constexpr int onV = 128 + (500 * onR - 419 * onG - 81 * onB) / 1000;
+
+		const int s = settings.scale;
+		const int outWidth = width * s;
+		const int outHeight = height * s;
+		unsigned char* yPlane = scratch.data();
+		unsigned char* uPlane = yPlane + outWidth * outHeight;
+		unsigned char* vPlane = uPlane + (outWidth / 2) * (outHeight / 2);
+
+		for (int y = 0; y < outHeight; ++y) {
+			const unsigned char* row = &slot.pixels[(y / s) * width];
+			for (int x = 0; x < outWidth; ++x)
+				yPlane[y * outWidth + x] = row[x / s] ? onY : 0;
+		}
+		// Scale is even, so each 2x2 chroma block lies inside a single source pixel
+		for (int y = 0; y < outHeight / 2; ++y) {
+			const unsigned char* row = &slot.pixels[(y * 2 / s) * width];
+			for (int x = 0; x < outWidth / 2; ++x) {
+				bool on = row[x * 2 / s] != 0;
+				uPlane[y * (outWidth / 2) + x] = on ? onU : 128;
+				vPlane[y * (outWidth / 2) + x] = on ? onV : 128;
+			}
+		}
+
+		out << "FRAME\n";
+		out.write(reinterpret_cast<const char*>(scratch.data()), scratch.size());
+		return (bool)out;
+	}
+
+	bool writeHash(const Slot& slot) {
+		// Frame indices are the presented frame number, so drops show up as gaps,
+		// and the rolling hash on the next line still includes the dropped frames
+		char line[64];
+		int length = snprintf(line, sizeof(line), "%llu %016llx %016llx\n", slot.index,
+			(unsigned long long)slot.frameHash, (unsigned long long)slot.rollingHash);
+		out.write(line, length);
+		return (bool)out;
+	}
+};
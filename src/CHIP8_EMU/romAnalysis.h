@@ -0,0 +1,122 @@
+﻿#pragma once
+#include "stdafx.h"
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+// Load-time static analysis of a ROM. One walk over the reachable code is a few
+// microseconds, so it's redone on every load rather than cached anywhere.
+
+enum class RomPlatform {
+	Chip8,
+	SuperChip  // Uses SUPER-CHIP only opcodes, which Chip8 mostly doesn't implement
+};
+
+struct RomAnalysis {
+	// A guess (a stray DXY0 may just be a CHIP-8 bug), so it only picks quirks
+	// when the user opts in with --quirk-bxnn auto
+	RomPlatform platform = RomPlatform::Chip8;
+	std::bitset<4096> idleLoops; // Jumps to self, and 0xFX0A key waits
+};
+
+// Walks every path reachable from 0x200 and records what it finds
+inline void analyseRom(const Chip8& chip, RomAnalysis& analysis) {
+	analysis = RomAnalysis();
+
+	std::bitset<4096> visited;
+	std::vector<unsigned short> pending;
+	pending.reserve(256);
+	pending.push_back(0x200);
+
+	auto branchTo = [&](unsigned int address) {
+		if (address <= 0xFFE)
+			pending.push_back((unsigned short)address);
+	};
+
+	while (!pending.empty()) {
+		unsigned int pc = pending.back();
+		pending.pop_back();
+
+		// Follow straight-line code until the block ends
+		while (pc <= 0xFFE && !visited[pc]) {
+			visited.set(pc);
+			unsigned short op = chip.memory[pc] << 8 | chip.memory[pc + 1];
+			unsigned int nnn = op & 0x0FFF;
+			bool fallsThrough = true;
+
+			switch (op & 0xF000) {
+			case 0x0000:
+				if (op == 0x00EE) {
+					fallsThrough = false;
+				}
+				else if (op != 0x00E0) {
+					if ((op & 0xFFF0) == 0x00C0 || (op >= 0x00FB && op <= 0x00FF))
+						analysis.platform = RomPlatform::SuperChip;
+					fallsThrough = false; // 0NNN never advances the pc in emulateCycle
+				}
+				break;
+			case 0x1000:
+				if (nnn == pc)
+					analysis.idleLoops.set(pc);
+				else
+					branchTo(nnn);
+				fallsThrough = false;
+				break;
+			case 0x2000:
+				branchTo(nnn);
+				branchTo(pc + 2); // Where the subroutine returns to
+				fallsThrough = false;
+				break;
+			case 0x3000: case 0x4000: case 0x5000: case 0x9000:
+				branchTo(pc + 2);
+				branchTo(pc + 4);
+				fallsThrough = false;
+				break;
+			case 0xB000:
+				// Target depends on a register, the walk just ends here
+				fallsThrough = false;
+				break;
+			case 0xD000:
+				if ((op & 0x000F) == 0)
+					analysis.platform = RomPlatform::SuperChip; // 16x16 sprite
+				break;
+			case 0xE000:
+				if ((op & 0x00FF) == 0x9E || (op & 0x00FF) == 0xA1) {
+					branchTo(pc + 2);
+					branchTo(pc + 4);
+					fallsThrough = false;
+				}
+				break;
+			case 0xF000:
+				switch (op & 0x00FF) {
+				case 0x0A: analysis.idleLoops.set(pc); break;
+				case 0x30: case 0x75: case 0x85: analysis.platform = RomPlatform::SuperChip; break;
+				default: break;
+				}
+				break;
+			default:
+				break;
+			}
+
+			if (!fallsThrough)
+				break;
+			pc += 2;
+		}
+	}
+}
+
+inline void applyRomAnalysis(const RomAnalysis& analysis, Chip8& chip) {
+	chip.idleLoops = analysis.idleLoops;
+}
+
+// initialise() + loadGame() + analysis, leaving chip ready to run or to use as
+// a Chip8Env start snapshot
+inline void loadAnalysedGame(const std::string& gameName, Chip8& chip, RomAnalysis& analysis) {
+	chip.initialise();
+	chip.loadGame(gameName);
+	analyseRom(chip, analysis);
+	applyRomAnalysis(analysis, chip);
+}
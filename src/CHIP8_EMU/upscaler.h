@@ -0,0 +1,349 @@
+﻿#pragma once
+#include "stdafx.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define UPSCALER_SSE2 1
+#endif
+
+#include <SDL/include/SDL.h>
+
+// CPU upscaler for the 64 x 32 framebuffer, so the window can be any integer
+// multiple of it without GPU shaders or SDL_RenderSetScale.
+// Stages, all done per frame:
+//   1. Phosphor persistence at source resolution (one intensity byte per pixel)
+//   2. Optional edge smoothing (Scale2x / Scale3x / EPX) on those intensities
+//   3. Integer nearest-neighbour expansion through a colour lookup table,
+//      straight into the locked memory of a streaming texture
+// Stage 3 only touches rows whose stage 2 output changed since the last frame:
+// each run of changed rows is locked and written on its own, and the rest of
+// the texture keeps what it already holds.
+
+enum class SmoothingFilter {
+	None,
+	Scale2x,
+	Scale3x,
+	EPX // Same rules as Scale2x (they were found independently), kept as its own name
+};
+
+struct UpscaleSettings {
+	int scale = 10;           // Output is 64*scale x 32*scale
+	SmoothingFilter filter = SmoothingFilter::None;
+	bool scanlines = false;   // Darkens the last output row of every source pixel (needs scale > 1)
+	int scanlineLevel = 128;  // 0-256, brightness of the scanline rows
+	int persistence = 0;      // 0-255, how much of a pixel's brightness is kept each frame after it turns off
+	uint32_t onColour = 0xFFFF0000;  // ARGB, red like clearScreen() used
+	uint32_t offColour = 0xFF000000;
+};
+
+class Upscaler {
+public:
+	static const int sourceWidth = 64;
+	static const int sourceHeight = 32;
+	static const int maxScale = 128; // 8192 wide, the largest texture most renderers allow
+
+	~Upscaler() { release(); }
+
+	bool setup(SDL_Renderer* renderer, const UpscaleSettings& upscaleSettings) {
+		release();
+		settings = upscaleSettings;
+		if (settings.scale < 1)
+			settings.scale = 1;
+		if (settings.scale > maxScale)
+			settings.scale = maxScale;
+
+		filterScale = 1;
+		if (settings.filter == SmoothingFilter::Scale2x || settings.filter == SmoothingFilter::EPX)
+			filterScale = 2;
+		else if (settings.filter == SmoothingFilter::Scale3x)
+			filterScale = 3;
+		if (settings.scale % filterScale != 0) {
+			printf("UPSCALER: Scale %i is not a multiple of the filter's %ix, smoothing disabled\n",
+				settings.scale, filterScale);
+			settings.filter = SmoothingFilter::None;
+			filterScale = 1;
+		}
+		blockScale = settings.scale / filterScale;
+
+		filteredWidth = sourceWidth * filterScale;
+		filteredHeight = sourceHeight * filterScale;
+		outWidth = sourceWidth * settings.scale;
+		outHeight = sourceHeight * settings.scale;
+
+		intensity.fill(0);
+		filtered.assign(filteredWidth * filteredHeight, 0);
+		prevFiltered.assign(filteredWidth * filteredHeight, 0);
+		dirtyRows.assign(filteredHeight, 0);
+		buildColourTables();
+		forceRedraw = true;
+		fading = false;
+
+		texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+			SDL_TEXTUREACCESS_STREAMING, outWidth, outHeight);
+		if (!texture) {
+			fprintf(stderr, "Could not create upscaler texture: %s\n", SDL_GetError());
+			return false;
+		}
+		return true;
+	}
+
+	int width() const { return outWidth; }
+	int height() const { return outHeight; }
+
+	// True while persistence is still fading pixels out, keep rendering until it isn't
+	bool animating() const { return fading; }
+
+	void render(const std::array<unsigned char, sourceWidth * sourceHeight>& gfx) {
+		if (!texture)
+			return;
+		updateIntensity(gfx);
+
+		switch (settings.filter) {
+		case SmoothingFilter::Scale2x:
+		case SmoothingFilter::EPX:
+			scale2x();
+			break;
+		case SmoothingFilter::Scale3x:
+			scale3x();
+			break;
+		default:
+			std::memcpy(filtered.data(), intensity.data(), intensity.size());
+			break;
+		}
+
+		for (int y = 0; y < filteredHeight; ++y) {
+			dirtyRows[y] = forceRedraw
+				|| std::memcmp(&filtered[y * filteredWidth], &prevFiltered[y * filteredWidth], filteredWidth) != 0;
+		}
+
+		bool allWritten = true;
+		int y = 0;
+		while (y < filteredHeight) {
+			if (!dirtyRows[y]) {
+				++y;
+				continue;
+			}
+			int runEnd = y;
+			while (runEnd < filteredHeight && dirtyRows[runEnd])
+				++runEnd;
+			allWritten = writeRun(y, runEnd) && allWritten;
+			y = runEnd;
+		}
+		// A failed lock leaves the texture stale, so try everything again next frame
+		forceRedraw = !allWritten;
+	}
+
+	void present(SDL_Renderer* renderer) {
+		SDL_RenderCopy(renderer, texture, NULL, NULL);
+	}
+
+	// Must happen before the renderer that owns the texture is destroyed
+	void release() {
+		if (texture)
+			SDL_DestroyTexture(texture);
+		texture = nullptr;
+	}
+
+private:
+	UpscaleSettings settings;
+	SDL_Texture* texture = nullptr;
+
+	int filterScale = 1;  // From the smoothing filter
+	int blockScale = 1;   // Nearest-neighbour factor applied after it
+	int filteredWidth = sourceWidth;
+	int filteredHeight = sourceHeight;
+	int outWidth = sourceWidth;
+	int outHeight = sourceHeight;
+
+	std::array<unsigned char, sourceWidth * sourceHeight> intensity;
+	std::vector<unsigned char> filtered;
+	std::vector<unsigned char> prevFiltered;
+	std::vector<unsigned char> dirtyRows;
+
+	// Intensity (0-255) -> ARGB, plain and for scanline rows
+	std::array<uint32_t, 256> colourTable;
+	std::array<uint32_t, 256> scanlineTable;
+	// Intensity -> intensity one frame later, once the pixel is off
+	std::array<unsigned char, 256> decayTable;
+
+	bool forceRedraw = true;
+	bool fading = false;
+
+	static uint32_t blendChannel(uint32_t from, uint32_t to, int shift, int amount, int scale) {
+		int a = (from >> shift) & 0xFF;
+		int b = (to >> shift) & 0xFF;
+		int mixed = a + (b - a) * amount / 255;
+		return (uint32_t)((mixed * scale) >> 8) << shift;
+	}
+
+	void buildColourTables() {
+		for (int i = 0; i < 256; ++i) {
+			uint32_t plain = 0xFF000000;
+			uint32_t dimmed = 0xFF000000;
+			for (int shift = 0; shift <= 16; shift += 8) {
+				plain |= blendChannel(settings.offColour, settings.onColour, shift, i, 256);
+				dimmed |= blendChannel(settings.offColour, settings.onColour, shift, i, settings.scanlineLevel);
+			}
+			colourTable[i] = plain;
+			scanlineTable[i] = dimmed;
+			// Over 256 so even persistence 255 loses a step each frame and reaches 0
+			decayTable[i] = (unsigned char)(i * settings.persistence / 256);
+		}
+	}
+
+	void updateIntensity(const std::array<unsigned char, sourceWidth * sourceHeight>& gfx) {
+		if (settings.persistence == 0) {
+			for (int i = 0; i < sourceWidth * sourceHeight; ++i)
+				intensity[i] = gfx[i] ? 255 : 0;
+			return;
+		}
+		bool anyFading = false;
+		for (int i = 0; i < sourceWidth * sourceHeight; ++i) {
+			unsigned char value = gfx[i] ? 255 : decayTable[intensity[i]];
+			anyFading |= (value != 0 && value != 255);
+			intensity[i] = value;
+		}
+		fading = anyFading;
+	}
+
+	// Scale2x / EPX: each pixel P becomes a 2x2 block, corners take a neighbour's
+	// value where the two neighbours touching that corner agree
+	//   A        1 2
+	// C P B  ->  3 4
+	//   D
+	// https://www.scale2x.it/algorithm
+	void scale2x() {
+		for (int y = 0; y < sourceHeight; ++y) {
+			for (int x = 0; x < sourceWidth; ++x) {
+				unsigned char p = source(x, y);
+				unsigned char a = source(x, y - 1);
+				unsigned char b = source(x + 1, y);
+				unsigned char c = source(x - 1, y);
+				unsigned char d = source(x, y + 1);
+
+				unsigned char* out = &filtered[(y * 2) * filteredWidth + x * 2];
+				if (b != c && a != d) {
+					out[0] = (c == a) ? c : p;
+					out[1] = (a == b) ? b : p;
+					out[filteredWidth] = (d == c) ? c : p;
+					out[filteredWidth + 1] = (b == d) ? b : p;
+				}
+				else {
+					out[0] = out[1] = out[filteredWidth] = out[filteredWidth + 1] = p;
+				}
+			}
+		}
+	}
+
+	// Scale3x: same idea on a 3x3 block, using the diagonal neighbours too
+	//   A B C
+	//   D E F
+	//   G H I
+	void scale3x() {
+		for (int y = 0; y < sourceHeight; ++y) {
+			for (int x = 0; x < sourceWidth; ++x) {
+				unsigned char a = source(x - 1, y - 1), b = source(x, y - 1), c = source(x + 1, y - 1);
+				unsigned char d = source(x - 1, y), e = source(x, y), f = source(x + 1, y);
+				unsigned char g = source(x - 1, y + 1), h = source(x, y + 1), i = source(x + 1, y + 1);
+
+				unsigned char* out0 = &filtered[(y * 3) * filteredWidth + x * 3];
+				unsigned char* out1 = out0 + filteredWidth;
+				unsigned char* out2 = out1 + filteredWidth;
+				if (b != h && d != f) {
+					out0[0] = (d == b) ? d : e;
+					out0[1] = ((d == b && e != c) || (b == f && e != a)) ? b : e;
+					out0[2] = (b == f) ? f : e;
+					out1[0] = ((d == b && e != g) || (d == h && e != a)) ? d : e;
+					out1[1] = e;
+					out1[2] = ((b == f && e != i) || (h == f && e != c)) ? f : e;
+					out2[0] = (d == h) ? d : e;
+					out2[1] = ((d == h && e != i) || (h == f && e != g)) ? h : e;
+					out2[2] = (h == f) ? f : e;
+				}
+				else {
+					out0[0] = out0[1] = out0[2] = e;
+					out1[0] = out1[1] = out1[2] = e;
+					out2[0] = out2[1] = out2[2] = e;
+				}
+			}
+		}
+	}
+
+	// Clamped to the edge, so border pixels are treated as repeating outward
+	unsigned char source(int x, int y) const {
+		x = x < 0 ? 0 : (x >= sourceWidth ? sourceWidth - 1 : x);
+		y = y < 0 ? 0 : (y >= sourceHeight ? sourceHeight - 1 : y);
+		return intensity[y * sourceWidth + x];
+	}
+
+	// Locks the texture rows for filtered rows [first, end) and expands them in place.
+	// Locked memory is write-only, so every pixel in the rect gets written
+	bool writeRun(int first, int end) {
+		SDL_Rect band;
+		band.x = 0;
+		band.y = first * blockScale;
+		band.w = outWidth;
+		band.h = (end - first) * blockScale;
+
+		void* locked = nullptr;
+		int pitch = 0;
+		if (SDL_LockTexture(texture, &band, &locked, &pitch) != 0) {
+			fprintf(stderr, "Could not lock upscaler texture: %s\n", SDL_GetError());
+			return false;
+		}
+		for (int y = first; y < end; ++y) {
+			const unsigned char* row = &filtered[y * filteredWidth];
+			unsigned char* rowStart = static_cast<unsigned char*>(locked) + (y - first) * blockScale * pitch;
+			expandRow(row, y, rowStart, pitch);
+			std::memcpy(&prevFiltered[y * filteredWidth], row, filteredWidth);
+		}
+		SDL_UnlockTexture(texture);
+		return true;
+	}
+
+	// Writes blockScale output rows for one row of filtered intensities, starting
+	// at dst with pitch bytes between rows. The first plain row and the first
+	// scanline row are built from the lookup tables, the rest are copies of them.
+	// Scanlines follow the source pixel grid (every settings.scale rows), not the
+	// filtered one
+	void expandRow(const unsigned char* row, int y, unsigned char* dstRows, int pitch) {
+		const int firstOut = y * blockScale;
+		uint32_t* plainRow = nullptr;
+		uint32_t* darkRow = nullptr;
+		for (int r = 0; r < blockScale; ++r) {
+			const int outY = firstOut + r;
+			uint32_t* dst = reinterpret_cast<uint32_t*>(dstRows + r * pitch);
+			const bool scanline = settings.scanlines && settings.scale > 1
+				&& (outY % settings.scale) == settings.scale - 1;
+			uint32_t*& built = scanline ? darkRow : plainRow;
+			if (built) {
+				std::memcpy(dst, built, outWidth * sizeof(uint32_t));
+			}
+			else {
+				fillRow(row, dst, scanline ? scanlineTable : colourTable);
+				built = dst;
+			}
+		}
+	}
+
+	void fillRow(const unsigned char* row, uint32_t* out, const std::array<uint32_t, 256>& table) {
+		const int run = blockScale;
+		for (int x = 0; x < filteredWidth; ++x) {
+			const uint32_t colour = table[row[x]];
+			int i = 0;
+#ifdef UPSCALER_SSE2
+			const __m128i colours = _mm_set1_epi32((int)colour);
+			for (; i + 4 <= run; i += 4)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), colours);
+#endif
+			for (; i < run; ++i)
+				out[i] = colour;
+			out += run;
+		}
+	}
+};